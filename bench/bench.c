@@ -0,0 +1,331 @@
+/*
+Host benchmarks for the physics and geometry kernels in src/main.c.
+
+Usage: bench [-o results.csv] [-c baseline.csv] [-t tolerance_percent]
+Results are printed as CSV and optionally written to a file in the same
+format the baseline is read back in. With -c, the exit code is 1 when any
+kernel is slower than the baseline by more than the tolerance, or makes
+more allocations than it did.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Count heap allocations made by the benchmarked kernels
+static unsigned long benchAllocs;
+#define malloc(size) (benchAllocs++, malloc(size))
+#define realloc(pointer, size) (benchAllocs++, realloc(pointer, size))
+
+#define BENCHMARK
+#include "../src/main.c"
+
+#undef malloc
+#undef realloc
+
+#define BENCH_MAP_SIZES 3
+#define BENCH_KERNELS 5
+#define BENCH_REPEATS 9 // Each kernel is run this many times and the median run is kept
+#define BENCH_MIN_RUN_NS 100000000ULL // Iterations are doubled until one run takes at least this long
+#define BENCH_RAYS 4096
+#define BENCH_TOLERANCE 10 // Percent slower than the baseline before a result counts as a regression
+#define BENCH_CONFIRM_RUNS 3 // A kernel that looks slower than its baseline is measured again up to this many times
+#define BENCH_MAX_RESULTS (BENCH_KERNELS * BENCH_MAP_SIZES)
+
+enum BenchKernel {BENCH_LINE_INTERSECTION, BENCH_POINT_ON_LINE, BENCH_LOAD_BOUNCE_LINES, BENCH_UPDATE_BULLETS, BENCH_TANK_COLLISIONS};
+static const char *BENCH_KERNEL_NAMES[BENCH_KERNELS] = {"lineIntersection", "pointOnLine", "loadBounceLines", "updateBullets", "handleTankCollisions"};
+static const uint8_t BENCH_MAP_WIDTHS[BENCH_MAP_SIZES] = {4, 8, MAP_WIDTH};
+static const uint8_t BENCH_MAP_HEIGHTS[BENCH_MAP_SIZES] = {4, 6, MAP_HEIGHT};
+
+struct BenchResult {
+    char kernel[32];
+    char map[8];
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+static struct BenchResult results[BENCH_MAX_RESULTS];
+static int resultsCount;
+static struct BenchResult baseline[BENCH_MAX_RESULTS];
+static int baselineCount;
+static volatile float benchSink; // Keeps the compiler from dropping kernel results
+static struct Point rayStarts[BENCH_RAYS];
+static struct Point rayEnds[BENCH_RAYS];
+static struct Bullet firedBullets[MAX_BULLETS];
+static unsigned long tolerance = BENCH_TOLERANCE;
+
+unsigned long long nowNs(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((unsigned long long)time.tv_sec * 1000000000ULL) + time.tv_nsec;
+}
+
+void generateBenchMap(uint8_t width, uint8_t height) {
+    // Walled off area in the top left of MAP, with random walls and fences inside
+    for (int y=0; y<MAP_HEIGHT; y++) {
+        for (int x=0; x<MAP_WIDTH; x++) {
+            if (x == 0 || y == 0 || x >= width-1 || y >= height-1) {
+                MAP[y][x] = 1;
+            } else {
+                uint8_t roll = randInt(0, 9);
+                MAP[y][x] = roll == 0 ? 1 : (roll == 1 ? 2 : 0);
+            }
+        }
+    }
+
+    // Make sure there is somewhere to stand
+    MAP[1][1] = 0;
+
+    loadBounceLines();
+    free(collisions);
+    collisions = malloc(bounceLinesCount * sizeof(struct Collision));
+}
+
+struct Point randomPoint(uint8_t width, uint8_t height) {
+    // Anywhere inside the border, possibly overlapping walls
+    struct Point point;
+    point.x = randInt(WALL_SIZE + TANK_RADIUS, ((width-1) * WALL_SIZE) - TANK_RADIUS);
+    point.y = randInt(WALL_SIZE + TANK_RADIUS, ((height-1) * WALL_SIZE) - TANK_RADIUS);
+    return point;
+}
+
+struct Point randomOpenPoint(uint8_t width, uint8_t height) {
+    // Somewhere inside an air tile, where a tank could fire from
+    struct Point point;
+    do {
+        point = randomPoint(width, height);
+    } while (MAP[(int)point.y / WALL_SIZE][(int)point.x / WALL_SIZE] != 0);
+    return point;
+}
+
+void fireBullets(uint8_t width, uint8_t height) {
+    // Fire every bullet slot from random spots at random aim angles, exactly like the player would
+    for (int i=0; i<MAX_BULLETS; i++) {
+        bullets[i].pathIndex = -1;
+    }
+    for (int i=0; i<MAX_BULLETS; i++) {
+        while (bullets[i].pathIndex == -1) {
+            struct Point position = randomOpenPoint(width, height);
+            X_POS = position.x;
+            Y_POS = position.y;
+            ARM_ANGLE = randInt(0, 255);
+            handleBulletFiring();
+        }
+    }
+}
+
+void runKernel(enum BenchKernel kernel, unsigned long iterations) {
+    switch (kernel) {
+        case BENCH_LINE_INTERSECTION:
+            for (unsigned long i=0; i<iterations; i++) {
+                struct BounceLine *line = &bounceLines[i % bounceLinesCount];
+                benchSink = lineIntersection(&rayStarts[i % BENCH_RAYS], &rayEnds[i % BENCH_RAYS], &line->start, &line->end).x;
+            }
+            break;
+        case BENCH_POINT_ON_LINE:
+            for (unsigned long i=0; i<iterations; i++) {
+                struct BounceLine *line = &bounceLines[i % bounceLinesCount];
+                benchSink = pointOnLine(line->start, line->end, rayStarts[i % BENCH_RAYS]);
+            }
+            break;
+        case BENCH_LOAD_BOUNCE_LINES:
+            for (unsigned long i=0; i<iterations; i++) {
+                loadBounceLines();
+            }
+            break;
+        case BENCH_UPDATE_BULLETS:
+            // The particle pool is emptied every frame so emitters always do real work.
+            // Bullets start from the same spot every run and are put back at the start of their path when they expire.
+            memcpy(bullets, firedBullets, sizeof(bullets));
+            for (unsigned long i=0; i<iterations; i++) {
+                particleCount = 0;
+                updateBullets();
+                for (int j=0; j<MAX_BULLETS; j++) {
+                    if (bullets[j].pathIndex == -1) bullets[j] = firedBullets[j];
+                }
+            }
+            break;
+        case BENCH_TANK_COLLISIONS:
+            for (unsigned long i=0; i<iterations; i++) {
+                struct Point position = rayStarts[i % BENCH_RAYS];
+                X_POS = position.x;
+                Y_POS = position.y;
+                handleTankCollisions();
+            }
+            break;
+    }
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+struct BenchResult *findBaseline(struct BenchResult *result) {
+    for (int i=0; i<baselineCount; i++) {
+        if (strcmp(baseline[i].kernel, result->kernel) == 0 && strcmp(baseline[i].map, result->map) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+bool isRegression(struct BenchResult *result, struct BenchResult *base) {
+    // Allocations are exact, so anything past the printed precision is a real change
+    return result->nsPerOp > base->nsPerOp * (100 + tolerance) / 100 || result->allocsPerOp > base->allocsPerOp + 0.0000005;
+}
+
+void measureKernel(enum BenchKernel kernel, struct BenchResult *result) {
+    // Find an iteration count that keeps timer jitter small next to the run
+    unsigned long iterations = 1;
+    while (true) {
+        unsigned long long startNs = nowNs();
+        runKernel(kernel, iterations);
+        if (nowNs() - startNs >= BENCH_MIN_RUN_NS) break;
+        iterations *= 2;
+    }
+
+    double nsPerOp[BENCH_REPEATS];
+    unsigned long allocs = 0;
+    for (int repeat=0; repeat<BENCH_REPEATS; repeat++) {
+        unsigned long startAllocs = benchAllocs;
+        unsigned long long startNs = nowNs();
+        runKernel(kernel, iterations);
+        nsPerOp[repeat] = (double)(nowNs() - startNs) / iterations;
+        allocs += benchAllocs - startAllocs;
+    }
+
+    qsort(nsPerOp, BENCH_REPEATS, sizeof(double), compareDoubles);
+    result->nsPerOp = nsPerOp[BENCH_REPEATS/2];
+    result->allocsPerOp = (double)allocs / ((double)iterations * BENCH_REPEATS);
+}
+
+void benchmarkKernel(enum BenchKernel kernel, uint8_t size) {
+    struct BenchResult *result = &results[resultsCount++];
+    snprintf(result->kernel, sizeof(result->kernel), "%s", BENCH_KERNEL_NAMES[kernel]);
+    snprintf(result->map, sizeof(result->map), "%dx%d", BENCH_MAP_WIDTHS[size], BENCH_MAP_HEIGHTS[size]);
+    measureKernel(kernel, result);
+
+    // A slow result is only kept if it shows up again, so a noisy moment on the machine isn't a regression
+    struct BenchResult *base = findBaseline(result);
+    for (int run=0; base != NULL && isRegression(result, base) && run<BENCH_CONFIRM_RUNS; run++) {
+        struct BenchResult retry = *result;
+        measureKernel(kernel, &retry);
+        if (retry.nsPerOp < result->nsPerOp) result->nsPerOp = retry.nsPerOp;
+    }
+}
+
+void runBenchmarks(void) {
+    for (uint8_t size=0; size<BENCH_MAP_SIZES; size++) {
+        // Same maps and angles every run so results are comparable. Reseeded for each map
+        // since the particle emitters also draw random numbers, as many times as a kernel runs
+        srandom(size);
+        uint8_t width = BENCH_MAP_WIDTHS[size];
+        uint8_t height = BENCH_MAP_HEIGHTS[size];
+        generateBenchMap(width, height);
+
+        // Random rays at random aim angles, like handleBulletFiring() casts
+        for (int i=0; i<BENCH_RAYS; i++) {
+            float angle = BYTEANGLE_TO_RADIANS(randInt(0, 255));
+            rayStarts[i] = randomOpenPoint(width, height);
+            rayEnds[i].x = rayStarts[i].x + (cos(angle) * RAY_LENGTH);
+            rayEnds[i].y = rayStarts[i].y - (sin(angle) * RAY_LENGTH);
+        }
+
+        // Bullets flying along real wall paths
+        fireBullets(width, height);
+        memcpy(firedBullets, bullets, sizeof(bullets));
+
+        for (int kernel=0; kernel<BENCH_KERNELS; kernel++) {
+            benchmarkKernel(kernel, size);
+        }
+    }
+}
+
+bool writeResults(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "kernel,map,ns_per_op,allocs_per_op\n");
+    for (int i=0; i<resultsCount; i++) {
+        fprintf(file, "%s,%s,%.3f,%.6f\n", results[i].kernel, results[i].map, results[i].nsPerOp, results[i].allocsPerOp);
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool readBaseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL && baselineCount < BENCH_MAX_RESULTS) {
+        struct BenchResult *result = &baseline[baselineCount];
+        if (sscanf(line, "%31[^,],%7[^,],%lf,%lf", result->kernel, result->map, &result->nsPerOp, &result->allocsPerOp) == 4) {
+            baselineCount++;
+        }
+        // Anything else, like the header, is skipped
+    }
+
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *outputPath = NULL;
+    const char *baselinePath = NULL;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+            tolerance = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-o results.csv] [-c baseline.csv] [-t tolerance_percent]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (baselinePath != NULL && !readBaseline(baselinePath)) {
+        fprintf(stderr, "Could not read baseline %s\n", baselinePath);
+        return 2;
+    }
+
+    runBenchmarks();
+
+    bool regressed = false;
+    printf("kernel,map,ns_per_op,allocs_per_op%s\n", baselinePath != NULL ? ",baseline_ns_per_op,baseline_allocs_per_op,status" : "");
+    for (int i=0; i<resultsCount; i++) {
+        struct BenchResult *result = &results[i];
+        printf("%s,%s,%.3f,%.6f", result->kernel, result->map, result->nsPerOp, result->allocsPerOp);
+        if (baselinePath == NULL) {
+            printf("\n");
+            continue;
+        }
+
+        struct BenchResult *base = findBaseline(result);
+        if (base == NULL) {
+            printf(",,,nobaseline\n");
+            continue;
+        }
+
+        const char *status = "ok";
+        if (isRegression(result, base)) {
+            status = "regression";
+            regressed = true;
+        }
+        printf(",%.3f,%.6f,%s\n", base->nsPerOp, base->allocsPerOp, status);
+    }
+
+    if (outputPath != NULL && !writeResults(outputPath)) {
+        fprintf(stderr, "Could not write results to %s\n", outputPath);
+        return 2;
+    }
+
+    return regressed ? 1 : 0;
+}
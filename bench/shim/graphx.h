@@ -0,0 +1,35 @@
+/* Host stand-in for the CE toolchain's graphx.h. Drawing does nothing */
+#ifndef graphx_include_file
+#define graphx_include_file
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint8_t width;
+    uint8_t height;
+    uint8_t data[];
+} gfx_sprite_t;
+
+#define gfx_CheckRectangleHotspot(master_x, master_y, master_width, master_height, test_x, test_y, test_width, test_height) \
+    (((test_x) < ((master_x) + (master_width))) && \
+    (((test_x) + (test_width)) > (master_x)) && \
+    ((test_y) < ((master_y) + (master_height))) && \
+    (((test_y) + (test_height)) > (master_y)))
+
+static inline void gfx_Begin(void) {}
+static inline void gfx_End(void) {}
+static inline void gfx_SetDrawBuffer(void) {}
+static inline void gfx_SwapDraw(void) {}
+static inline void gfx_Wait(void) {}
+static inline void gfx_SetPalette(void *palette, int size, uint8_t offset) {(void)palette; (void)size; (void)offset;}
+static inline void gfx_ZeroScreen(void) {}
+static inline void gfx_SetColor(uint8_t index) {(void)index;}
+static inline void gfx_FillRectangle(int x, int y, int width, int height) {(void)x; (void)y; (void)width; (void)height;}
+static inline void gfx_FillRectangle_NoClip(int x, int y, int width, int height) {(void)x; (void)y; (void)width; (void)height;}
+static inline void gfx_FillCircle(int x, int y, int radius) {(void)x; (void)y; (void)radius;}
+static inline void gfx_Line(int x0, int y0, int x1, int y1) {(void)x0; (void)y0; (void)x1; (void)y1;}
+static inline void gfx_TransparentSprite(gfx_sprite_t *sprite, int x, int y) {(void)sprite; (void)x; (void)y;}
+static inline void gfx_RotatedScaledTransparentSprite_NoClip(gfx_sprite_t *sprite, int x, int y, uint8_t angle, uint8_t scale) {(void)sprite; (void)x; (void)y; (void)angle; (void)scale;}
+
+#endif
@@ -0,0 +1,19 @@
+/* Host stand-in for the CE toolchain's keypadc.h. Nothing is ever pressed */
+#ifndef keypadc_include_file
+#define keypadc_include_file
+
+#include <stdint.h>
+
+static uint8_t kb_Data[8];
+static inline void kb_Scan(void) {}
+
+#define kb_Del (1<<7)
+#define kb_2nd (1<<5)
+#define kb_Alpha (1<<7)
+#define kb_Enter (1<<0)
+#define kb_Down (1<<0)
+#define kb_Left (1<<1)
+#define kb_Right (1<<2)
+#define kb_Up (1<<3)
+
+#endif
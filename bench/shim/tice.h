@@ -0,0 +1,11 @@
+/* Host stand-in for the CE toolchain's tice.h, only what src/main.c uses */
+#ifndef tice_include_file
+#define tice_include_file
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define randInt(min, max) ((unsigned)random() % ((max) - (min) + 1) + (min))
+
+#endif
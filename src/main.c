@@ -1,4 +1,5 @@
 #include <math.h>
+#include <time.h>
 #include <tice.h>
 #include <keypadc.h>
 #include <graphx.h>
@@ -16,6 +17,7 @@
 #define ARM_LENGTH (int)(TANK_RADIUS * 1.2)
 #define ARM_WIDTH (int)(TANK_RADIUS * 0.4)
 #define MOVEMENT_SPEED 1
+#define ARM_SPEED 2
 #define DISTANCE(x,y,p,q) sqrt((p-x)*(p-x) + (q-y)*(q-y))
 #define POINT_DISTANCE(a,b) DISTANCE(a.x,a.y,b.x,b.y)
 #define MAX_BULLETS 5
@@ -29,6 +31,19 @@
 #define WALL_OFFSET_Y (Y_POS-SCREEN_MIDDLE_Y)
 #define FLIP_RADIAN_HORIZONTALLY(r) (r - (cos(r) * PI))
 #define FLIP_RADIAN_VERTICALLY(r) (r - (sin(r) * PI))
+#define FIXED_SHIFT 8 // Particles use 8.8 fixed point
+#define TO_FIXED(n) ((int)((n) * (1 << FIXED_SHIFT)))
+#define FROM_FIXED(n) ((n) >> FIXED_SHIFT)
+#define MAX_PARTICLES 32 // Hard cap on particles updated and drawn per frame
+#define PARTICLE_PRESSURE (MAX_PARTICLES/2) // Past this many live particles, effects start degrading
+#define PARTICLE_DIRECTIONS 16
+#define PARTICLE_SIZE 2
+//#define LOW_LATENCY_INPUT // Poll the keypad again right before drawing the tank so the turret responds a frame sooner
+//#define MEASURE_LATENCY // Time key presses until the frame showing them is on screen, reported on exit
+#define LATENCY_BUCKETS 16
+#define LATENCY_BUCKET_MS 4
+#define ARM_KEY_RIGHT 1
+#define ARM_KEY_LEFT 2
 
 /*
 Tile IDs:
@@ -49,8 +64,8 @@ static uint8_t MAP[MAP_HEIGHT][MAP_WIDTH] = {
     {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
     {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
     {1, 0, 1, 1, 0, 0, 0, 0, 1, 1, 0, 1},
-    {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
-    {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1},
+    {1, 3, 3, 0, 0, 0, 0, 0, 0, 0, 0, 1},
+    {1, 3, 3, 0, 0, 0, 0, 0, 0, 0, 0, 1},
     {1, 0, 0, 1, 0, 2, 2, 0, 1, 0, 0, 1},
     {1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 1},
     {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
@@ -99,6 +114,8 @@ static uint8_t ARM_ANGLE = 0; // The arm angle in degrees from [0, 255]
 static struct Bullet bullets[MAX_BULLETS];
 static bool FIRE_PRESSED = false;
 void handleBulletFiring(void);
+void updateBullets(void);
+void handleTankCollisions(void);
 inline float floatMin(float a, float b);
 inline float floatMax(float a, float b);
 inline float floatAbs(float a);
@@ -109,11 +126,52 @@ inline int16_t getMapTile(int x, int y);
 static struct Collision *collisions;
 static int collisionIndex;
 static struct Point currentPoint;
+static uint16_t roofMask[MAP_HEIGHT]; // Bit x of row y is set when tile (x, y) has a roof. MAP_WIDTH must fit in 16 bits
+void loadRoofMask(void);
+bool isRoofTile(int x, int y);
+bool rectUnderRoof(int x, int y, int width, int height);
+
+// Particle pool, stored as struct-of-arrays. Live particles are packed into [0, particleCount)
+static int particleX[MAX_PARTICLES];
+static int particleY[MAX_PARTICLES];
+static int16_t particleVX[MAX_PARTICLES];
+static int16_t particleVY[MAX_PARTICLES];
+static uint8_t particleLife[MAX_PARTICLES];
+static uint8_t particleColor[MAX_PARTICLES];
+static uint8_t particleCount;
+// cos() of each particle direction in 8.8 fixed point. sin() is the same table shifted by a quarter turn
+static const int16_t PARTICLE_COS[PARTICLE_DIRECTIONS] = {256, 237, 181, 98, 0, -98, -181, -237, -256, -237, -181, -98, 0, 98, 181, 237};
+void emitParticles(struct Point origin, uint8_t count, uint8_t color, uint8_t speed, uint8_t life);
+void updateParticles(void);
+void drawParticles(void);
+
+static uint8_t stepArmKeys; // The arm keys that were held when step() scanned the keypad
+uint8_t readArmKeys(void);
+void lateInputPoll(void);
+#ifdef MEASURE_LATENCY
+enum InputSource {STEP_SCAN, LATE_SCAN};
+static uint8_t lastKbData[8]; // Keypad state as of the last scan, used to find key-down edges
+static bool latencyPending;
+static clock_t latencyInputTime;
+static clock_t latencyScanGap; // Time since the previous scan that could have seen the key, the most it can have been down unnoticed
+static enum InputSource latencySource;
+static clock_t lastScanTime;
+static clock_t lastStepScanTime;
+static unsigned int latencyHistogram[2][LATENCY_BUCKETS]; // Scan to screen
+static unsigned int latencyBoundHistogram[2][LATENCY_BUCKETS]; // Previous scan to screen, an upper bound for key down to screen
+uint8_t latencyKeyMask(enum InputSource source, uint8_t group);
+void recordInputEdges(enum InputSource source);
+void recordSwap(void);
+void addLatencySample(unsigned int *histogram, clock_t ticks);
+void printLatencyHistogram(const char *title, unsigned int *histogram);
+void reportLatency(void);
+#endif
 
 void begin(void) {
     X_POS = (MAP_WIDTH * WALL_SIZE)/2;
     Y_POS = (MAP_HEIGHT * WALL_SIZE)/2;
     loadBounceLines();
+    loadRoofMask();
     collisions = malloc(bounceLinesCount * sizeof(struct Collision)); // Initialize collisions to the maximum number of possible collisions
     collisionIndex = 0;
 
@@ -121,10 +179,16 @@ void begin(void) {
     for (int i=0; i<MAX_BULLETS; i++) {
         bullets[i].pathIndex = -1;
     }
+
+    // Empty the particle pool
+    particleCount = 0;
 }
 
 bool step(void) {
     kb_Scan();
+#ifdef MEASURE_LATENCY
+    recordInputEdges(STEP_SCAN);
+#endif
     if (kb_Data[1] & kb_Del) {
         // Exit the game
         dbg_sprintf(dbgout, "Exiting the game!\n");
@@ -132,13 +196,14 @@ bool step(void) {
     }
 
     // Check move arm right
-    if (kb_Data[1] & kb_2nd) {
-        ARM_ANGLE += 2; // It's ok if this overflows
+    stepArmKeys = readArmKeys();
+    if (stepArmKeys & ARM_KEY_RIGHT) {
+        ARM_ANGLE += ARM_SPEED; // It's ok if this overflows
     }
 
     // Check move arm left
-    if (kb_Data[2] & kb_Alpha) {
-        ARM_ANGLE -= 2; // It's ok if this overflows
+    if (stepArmKeys & ARM_KEY_LEFT) {
+        ARM_ANGLE -= ARM_SPEED; // It's ok if this overflows
     }
 
     // Check move tank up
@@ -161,6 +226,9 @@ bool step(void) {
         X_POS += MOVEMENT_SPEED;
     }
 
+    // Update particle positions before anything emits new ones, so new particles get drawn at least once
+    updateParticles();
+
     // Check for bullet firing
     if (kb_Data[6] & kb_Enter) {
         if (!FIRE_PRESSED) {
@@ -172,6 +240,15 @@ bool step(void) {
     }
 
     // Update bullet positions
+    updateBullets();
+
+    // Do collision checks
+    handleTankCollisions();
+
+    return true;
+}
+
+void updateBullets(void) {
     for (int i=0; i<MAX_BULLETS; i++) {
         struct Bullet *bullet = &bullets[i];
         if (bullet->pathIndex == -1) continue; // Skip this bullet since it doesn't exist
@@ -184,8 +261,10 @@ bool step(void) {
             if (bullet->pathIndex == BULLET_BOUNCES) {
                 // This is the end of this bullet! Mark this slot as empty
                 bullet->pathIndex = -1;
+                emitParticles(path->end, 10, 2, 6, 16); // Explosion
                 continue;
             }
+            emitParticles(path->end, 4, 4, 4, 8); // Ricochet, only reached when BULLET_BOUNCES > 1
 
             // Updated the path! Re-run this iteration
             i--;
@@ -197,8 +276,9 @@ bool step(void) {
         bullet->pos.x = path->start.x + ((path->end.x - path->start.x) * progress);
         bullet->pos.y = path->start.y + ((path->end.y - path->start.y) * progress);
     }
+}
 
-    // Do collision checks
+void handleTankCollisions(void) {
     int tileX = X_POS / WALL_SIZE;
     int tileY = Y_POS / WALL_SIZE;
     int cornerX = X_POS - TANK_RADIUS;
@@ -252,8 +332,6 @@ bool step(void) {
             }
         }
     }
-
-    return true;
 }
 
 void draw(void) {
@@ -280,11 +358,31 @@ void draw(void) {
     gfx_SetColor(1); // Set color to black
     for (int i=0; i<MAX_BULLETS; i++) {
         if (bullets[i].pathIndex == -1) continue;
+        if (rectUnderRoof(bullets[i].pos.x - BULLET_RADIUS, bullets[i].pos.y - BULLET_RADIUS, (BULLET_RADIUS*2) + 1, (BULLET_RADIUS*2) + 1)) continue; // Hidden by a roof, gfx_FillCircle() covers pos-radius to pos+radius
 
         gfx_FillCircle(bullets[i].pos.x - WALL_OFFSET_X, bullets[i].pos.y - WALL_OFFSET_Y, BULLET_RADIUS);
     }
 
-    // Draw tank bodies
+    // Draw particles
+    drawParticles();
+
+    // Draw roofs over everything below them
+    gfx_SetColor(5); // Set color to dark grey
+    for (uint8_t y=0; y<MAP_HEIGHT; y++) {
+        if (roofMask[y] == 0) continue; // No roofs in this row
+        for (uint8_t x=0; x<MAP_WIDTH; x++) {
+            if (roofMask[y] & (1 << x)) {
+                gfx_FillRectangle((x * WALL_SIZE) - WALL_OFFSET_X, (y * WALL_SIZE) - WALL_OFFSET_Y, WALL_SIZE, WALL_SIZE);
+            }
+        }
+    }
+
+#ifdef LOW_LATENCY_INPUT
+    // Catch any turret input that happened while the rest of the frame was drawn
+    lateInputPoll();
+#endif
+
+    // Draw tank bodies (the player's own tank always stays visible above roofs)
     gfx_SetColor(3); // Set color to blue
     gfx_FillRectangle_NoClip(SCREEN_MIDDLE_X - TANK_RADIUS, SCREEN_MIDDLE_Y - TANK_RADIUS, TANK_SIZE, TANK_SIZE);
 
@@ -310,6 +408,9 @@ void draw(void) {
 
 void end(void) {
     // Exit graphics
+#ifdef MEASURE_LATENCY
+    reportLatency();
+#endif
 }
 
 
@@ -324,6 +425,10 @@ void game(void) {
     while (step()) { // No rendering allowed in step!
         draw(); // As little non-rendering logic as possible
         gfx_SwapDraw(); // Queue the buffered frame to be displayed
+#ifdef MEASURE_LATENCY
+        gfx_Wait(); // Wait for the swap to actually reach the screen before timing it
+        recordSwap();
+#endif
     }
 
     gfx_End();
@@ -382,7 +487,7 @@ void handleBulletFiring(void) {
         // Find the closest collision
         float closestDistance = POINT_DISTANCE(currentPoint, collisions[0].point);
         int closestIndex = 0;
-        for (int j=1; j<(MAP_WIDTH*MAP_HEIGHT*4); j++) {
+        for (int j=1; j<collisionIndex; j++) {
             float distance = POINT_DISTANCE(currentPoint, collisions[j].point);
             if (distance < closestDistance) {
                 closestDistance = distance;
@@ -416,10 +521,197 @@ void handleBulletFiring(void) {
         dbg_sprintf(dbgout, "After angle: %f\n", currentAngle);
     }
 
+    // Muzzle flash at the end of the arm
+    float armAngle = BYTEANGLE_TO_RADIANS(ARM_ANGLE);
+    struct Point muzzlePoint;
+    muzzlePoint.x = X_POS + (cos(armAngle) * ARM_LENGTH);
+    muzzlePoint.y = Y_POS - (sin(armAngle) * ARM_LENGTH);
+    emitParticles(muzzlePoint, 3, 5, 2, 4);
+
     // Assign this bullet
     bullets[bulletIndex].pathIndex = 0;
 }
 
+void emitParticles(struct Point origin, uint8_t count, uint8_t color, uint8_t speed, uint8_t life) {
+    /* Speed is in quarter pixels per frame and life is in frames.
+    When the pool is under pressure, effects shrink instead of piling up,
+    so the per-frame particle cost never goes past MAX_PARTICLES.
+    */
+    if (particleCount >= PARTICLE_PRESSURE) {
+        count = (count + 1) / 2;
+        life = (life + 1) / 2;
+    }
+    if (count > MAX_PARTICLES - particleCount) count = MAX_PARTICLES - particleCount;
+    if (count == 0) return; // The pool is full, drop this effect
+
+    int x = TO_FIXED(origin.x);
+    int y = TO_FIXED(origin.y);
+    uint8_t direction = randInt(0, PARTICLE_DIRECTIONS-1); // Random starting direction so effects don't all look the same
+    uint8_t directionStep = PARTICLE_DIRECTIONS / count;
+    if (directionStep == 0) directionStep = 1;
+
+    for (uint8_t i=0; i<count; i++) {
+        uint8_t index = particleCount++;
+        particleX[index] = x;
+        particleY[index] = y;
+        particleVX[index] = (PARTICLE_COS[direction] * speed) / 4;
+        particleVY[index] = (PARTICLE_COS[(direction + (PARTICLE_DIRECTIONS - PARTICLE_DIRECTIONS/4)) % PARTICLE_DIRECTIONS] * speed) / 4;
+        particleLife[index] = life;
+        particleColor[index] = color;
+        direction = (direction + directionStep) % PARTICLE_DIRECTIONS;
+    }
+}
+
+void updateParticles(void) {
+    // Age faster while there are a lot of particles alive
+    uint8_t aging = particleCount > PARTICLE_PRESSURE ? 2 : 1;
+
+    for (int i=0; i<particleCount; i++) {
+        if (particleLife[i] <= aging) {
+            // This particle is dead! Move the last particle into its slot
+            particleCount--;
+            particleX[i] = particleX[particleCount];
+            particleY[i] = particleY[particleCount];
+            particleVX[i] = particleVX[particleCount];
+            particleVY[i] = particleVY[particleCount];
+            particleLife[i] = particleLife[particleCount];
+            particleColor[i] = particleColor[particleCount];
+
+            // Re-run this iteration for the moved particle
+            i--;
+            continue;
+        }
+
+        particleLife[i] -= aging;
+        particleX[i] += particleVX[i];
+        particleY[i] += particleVY[i];
+
+        // Slow down a little each frame
+        particleVX[i] -= particleVX[i] / 8;
+        particleVY[i] -= particleVY[i] / 8;
+    }
+}
+
+void drawParticles(void) {
+    for (uint8_t i=0; i<particleCount; i++) {
+        if (rectUnderRoof(FROM_FIXED(particleX[i]), FROM_FIXED(particleY[i]), PARTICLE_SIZE, PARTICLE_SIZE)) continue; // Hidden by a roof
+        gfx_SetColor(particleColor[i]);
+        gfx_FillRectangle(FROM_FIXED(particleX[i]) - WALL_OFFSET_X, FROM_FIXED(particleY[i]) - WALL_OFFSET_Y, PARTICLE_SIZE, PARTICLE_SIZE);
+    }
+}
+
+uint8_t readArmKeys(void) {
+    uint8_t keys = 0;
+    if (kb_Data[1] & kb_2nd) keys |= ARM_KEY_RIGHT;
+    if (kb_Data[2] & kb_Alpha) keys |= ARM_KEY_LEFT;
+    return keys;
+}
+
+void lateInputPoll(void) {
+    /* Only the turret is updated here. Anything else would
+    need the world that was already drawn to move with it.
+    Presses and releases since step() are applied now, and
+    step() carries on from there on the next frame.
+    */
+    kb_Scan();
+#ifdef MEASURE_LATENCY
+    recordInputEdges(LATE_SCAN);
+#endif
+    uint8_t keys = readArmKeys();
+    uint8_t pressed = keys & ~stepArmKeys;
+    uint8_t released = stepArmKeys & ~keys;
+
+    if (pressed & ARM_KEY_RIGHT) ARM_ANGLE += ARM_SPEED;
+    if (released & ARM_KEY_RIGHT) ARM_ANGLE -= ARM_SPEED;
+    if (pressed & ARM_KEY_LEFT) ARM_ANGLE -= ARM_SPEED;
+    if (released & ARM_KEY_LEFT) ARM_ANGLE += ARM_SPEED;
+    stepArmKeys = keys;
+}
+
+#ifdef MEASURE_LATENCY
+uint8_t latencyKeyMask(enum InputSource source, uint8_t group) {
+    /* Only keys that change the next frame are timed. The late scan only
+    affects the turret, so it only owns the arm keys. Del is left out since
+    it exits without drawing another frame, and Enter only counts when a
+    bullet slot is free for it to fire.
+    */
+    if (group == 1) return kb_2nd;
+    if (group == 2) return kb_Alpha;
+    if (source == LATE_SCAN) return 0;
+    if (group == 7) return kb_Up | kb_Down | kb_Left | kb_Right;
+    if (group == 6) {
+        for (uint8_t i=0; i<MAX_BULLETS; i++) {
+            if (bullets[i].pathIndex == -1) return kb_Enter;
+        }
+    }
+    return 0;
+}
+
+void recordInputEdges(enum InputSource source) {
+    clock_t now = clock();
+
+    for (uint8_t group=1; group<8; group++) {
+        uint8_t mask = latencyKeyMask(source, group);
+        uint8_t pressed = kb_Data[group] & ~lastKbData[group] & mask;
+        lastKbData[group] = (lastKbData[group] & ~mask) | (kb_Data[group] & mask);
+
+        if (pressed && !latencyPending && lastStepScanTime != 0) {
+            // Keys only the step scan owns could have gone down any time since the previous step scan
+            clock_t previousScan = (pressed & ~latencyKeyMask(LATE_SCAN, group)) ? lastStepScanTime : lastScanTime;
+            latencyPending = true;
+            latencyInputTime = now;
+            latencyScanGap = now - previousScan;
+            latencySource = source;
+        }
+    }
+
+    lastScanTime = now;
+    if (source == STEP_SCAN) lastStepScanTime = now;
+}
+
+void recordSwap(void) {
+    // Every timed key takes effect in the frame it was scanned in, so this swap is the first to show it
+    if (!latencyPending) return;
+    latencyPending = false;
+
+    clock_t elapsed = clock() - latencyInputTime;
+    addLatencySample(latencyHistogram[latencySource], elapsed);
+    addLatencySample(latencyBoundHistogram[latencySource], elapsed + latencyScanGap);
+}
+
+void addLatencySample(unsigned int *histogram, clock_t ticks) {
+    unsigned long ms = ((unsigned long)ticks * 1000) / CLOCKS_PER_SEC;
+    unsigned long bucket = ms / LATENCY_BUCKET_MS;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1; // Last bucket holds everything slower
+    histogram[bucket]++;
+}
+
+void printLatencyHistogram(const char *title, unsigned int *histogram) {
+    dbg_sprintf(dbgout, "%s:\n", title);
+    for (uint8_t i=0; i<LATENCY_BUCKETS; i++) {
+        if (histogram[i] == 0) continue;
+        if (i == LATENCY_BUCKETS-1) {
+            dbg_sprintf(dbgout, "%d+ ms: %u\n", i * LATENCY_BUCKET_MS, histogram[i]);
+        } else {
+            dbg_sprintf(dbgout, "%d-%d ms: %u\n", i * LATENCY_BUCKET_MS, (i+1) * LATENCY_BUCKET_MS, histogram[i]);
+        }
+    }
+}
+
+void reportLatency(void) {
+    /* The scan to screen times can't be compared between the two scans,
+    since the late scan starts its clock later in the frame. Compare the
+    upper bounds instead, which also count the time since the previous scan.
+    */
+    dbg_sprintf(dbgout, "Input latency. Scan to screen leaves out the time between the key going down and the scan.\n");
+    dbg_sprintf(dbgout, "Previous scan to screen is the upper bound for key down to screen.\n");
+    printLatencyHistogram("Step scan, scan to screen", latencyHistogram[STEP_SCAN]);
+    printLatencyHistogram("Step scan, previous scan to screen", latencyBoundHistogram[STEP_SCAN]);
+    printLatencyHistogram("Late scan, scan to screen", latencyHistogram[LATE_SCAN]);
+    printLatencyHistogram("Late scan, previous scan to screen", latencyBoundHistogram[LATE_SCAN]);
+}
+#endif
+
 inline float floatMin(float a, float b) {
     if (a < b) return a;
     else return b;
@@ -490,6 +782,34 @@ inline int16_t getMapTile(int x, int y) {
     return MAP[y][x];
 }
 
+void loadRoofMask(void) {
+    for (int y=0; y<MAP_HEIGHT; y++) {
+        roofMask[y] = 0;
+        for (int x=0; x<MAP_WIDTH; x++) {
+            uint8_t value = MAP[y][x];
+            if (value == 3 || value == 5 || value == 7) {
+                roofMask[y] |= (1 << x);
+            }
+        }
+    }
+}
+
+bool isRoofTile(int x, int y) {
+    if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return false;
+    return roofMask[y] & (1 << x);
+}
+
+bool rectUnderRoof(int x, int y, int width, int height) {
+    /* Objects are never bigger than a tile, so the rectangle is
+    completely covered when all four of its corners are.
+    */
+    int leftX = x / WALL_SIZE;
+    int rightX = (x + width - 1) / WALL_SIZE;
+    int topY = y / WALL_SIZE;
+    int bottomY = (y + height - 1) / WALL_SIZE;
+    return isRoofTile(leftX, topY) && isRoofTile(rightX, topY) && isRoofTile(leftX, bottomY) && isRoofTile(rightX, bottomY);
+}
+
 void loadBounceLines(void) {
     free(bounceLines);
     bounceLinesCount = 0;
@@ -504,7 +824,7 @@ void loadBounceLines(void) {
             int topY = y * WALL_SIZE;
             int bottomY = (y+1) * WALL_SIZE;
 
-            if (value == 0 || value == 2) {
+            if (value != 1) {
                 if (getMapTile(x-1, y) == 1) {
                     // Tile to the left is solid
                     bounceLinesCount++;
@@ -584,9 +904,11 @@ void loadBounceLines(void) {
     }
 }
 
+#ifndef BENCHMARK // The host benchmarks in bench/ include this file and bring their own main()
 /* Main function, called first */
 int main(void)
 {
     game();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file